@@ -0,0 +1,510 @@
+// Authors: Tunaberk Almaci, Aybars Inci
+//
+// Benchmark suite for the shell's hot paths. Every benchmark drives the code
+// the way a command line does, through parse_command() and process_command(),
+// and reports percentiles over its rounds. Results are written as JSON so two
+// commits can be compared with a plain diff or a script.
+//
+//   make bench && ./bench/bench [options] [benchmark ...]
+//
+//   -o file   results file (default bench-results.json)
+//   -t tag    label stored with the results, e.g. a commit id
+//   -c file   parse corpus (default bench/commands.txt)
+//   -n count  rounds of the short benchmarks (default 2000)
+//   -r count  rounds of the large file benchmarks (default 3)
+//   -s MB     highlight input size (default 1024)
+//   -k MB     kdiff input size (default 256)
+//   -p MB     bytes pushed through the pipeline per round (default 256)
+//
+// Benchmarks: parse path_finder spawn pipeline highlight kdiff shortdir
+
+#define SEASHELL_NO_MAIN
+#include "../seashell.c"
+
+#define BENCH_MAX_RESULTS 16
+#define SHORTDIR_ENTRIES 100000
+
+struct bench_result
+{
+	const char *name;
+	const char *unit;
+	bool higher_is_better;
+	int samples;
+	double min, p50, p90, p99, max, mean;
+};
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static int result_count;
+static char work_dir[PATH_MAX];
+static int saved_stdout = -1;
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+static void record(const char *name, const char *unit, bool higher_is_better, double *samples, int n)
+{
+	struct bench_result *r = &results[result_count++];
+	double total = 0;
+	qsort(samples, n, sizeof(double), compare_double);
+	for (int i = 0; i < n; ++i)
+		total += samples[i];
+	*r = (struct bench_result){name, unit, higher_is_better, n, samples[0], samples[(n - 1) / 2],
+							   samples[(n - 1) * 9 / 10], samples[(n - 1) * 99 / 100], samples[n - 1],
+							   total / n};
+	fprintf(stderr, "%-16s %8s  p50=%12.1f  p90=%12.1f  p99=%12.1f  (%d rounds)\n", name, unit,
+			r->p50, r->p90, r->p99, n);
+}
+/**
+ * Send the shell's output to /dev/null while a benchmark runs
+ */
+static void quiet(bool on)
+{
+	fflush(stdout);
+	if (on)
+	{
+		int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	}
+	else
+	{
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+	}
+}
+/**
+ * Run one command line like the shell's main loop does
+ */
+static int run_line(const char *text)
+{
+	char line[PATH_MAX * 4];
+	snprintf(line, sizeof(line), "%s", text);
+	struct command_t *command = arena_alloc(&line_arena, sizeof(struct command_t));
+	memset(command, 0, sizeof(struct command_t));
+	int code = parse_command(line, command);
+	if (code == SUCCESS)
+		code = process_command(command);
+	arena_reset(&line_arena);
+	return code;
+}
+/**
+ * Write `mb` megabytes of text lines. Every file written by this is the
+ * same, except that `edits` bytes spread over it are changed.
+ */
+static void make_text_file(const char *path, int mb, int edits)
+{
+	static const char *words[] = {"the", "shell", "process", "needle", "pipe", "fork", "exec",
+								  "signal", "terminal", "job", "buffer", "kernel", "file",
+								  "directory", "stream", "builtin"};
+	size_t block_size = 1 << 20;
+	char *block = malloc(block_size);
+	unsigned state = 12345;
+	size_t pos = 0;
+	while (pos < block_size)
+	{
+		int line_words = 4 + state % 12;
+		for (int w = 0; w < line_words && pos < block_size; ++w)
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			const char *word = words[state % (sizeof(words) / sizeof(words[0]))];
+			if (state % 64 != 0 && strcmp(word, "needle") == 0)
+				word = "haystack"; // keep matches rare
+			for (const char *c = word; *c && pos < block_size; ++c)
+				block[pos++] = *c;
+			if (pos < block_size)
+				block[pos++] = w + 1 == line_words ? '\n' : (state & 8 ? ',' : ' ');
+		}
+	}
+	block[block_size - 1] = '\n';
+
+	int stride = edits > 0 ? (mb / edits > 0 ? mb / edits : 1) : 0;
+	FILE *f = fopen(path, "w");
+	for (int i = 0; i < mb; ++i)
+	{
+		bool edited = stride && i % stride == stride / 2;
+		if (edited)
+			block[block_size / 2] ^= 0x20;
+		fwrite(block, 1, block_size, f);
+		if (edited)
+			block[block_size / 2] ^= 0x20;
+	}
+	fclose(f);
+	free(block);
+}
+
+static void bench_parse(const char *corpus_path, int rounds)
+{
+	FILE *corpus = fopen(corpus_path, "r");
+	if (corpus == NULL)
+	{
+		fprintf(stderr, "parse: %s: %s\n", corpus_path, strerror(errno));
+		return;
+	}
+	char **lines = NULL;
+	int line_count = 0;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+	while ((n = getline(&line, &cap, corpus)) > 0)
+	{
+		if (line[n - 1] == '\n')
+			line[--n] = 0;
+		lines = realloc(lines, sizeof(char *) * (line_count + 1));
+		lines[line_count++] = strdup(line);
+	}
+	fclose(corpus);
+	free(line);
+
+	double *samples = malloc(sizeof(double) * rounds);
+	quiet(true); // parse_command prints syntax errors
+	for (int r = 0; r < rounds; ++r)
+	{
+		double start = now_ns();
+		for (int i = 0; i < line_count; ++i)
+		{
+			struct command_t *command = arena_alloc(&line_arena, sizeof(struct command_t));
+			memset(command, 0, sizeof(struct command_t));
+			parse_command(lines[i], command);
+			arena_reset(&line_arena);
+		}
+		samples[r] = (now_ns() - start) / line_count;
+	}
+	quiet(false);
+	record("parse", "ns/line", false, samples, rounds);
+	for (int i = 0; i < line_count; ++i)
+		free(lines[i]);
+	free(lines);
+	free(samples);
+}
+static void bench_path_finder(int rounds)
+{
+	char path[PATH_MAX];
+	double *samples = malloc(sizeof(double) * rounds);
+	for (int r = 0; r < rounds; ++r)
+	{
+		double start = now_ns();
+		path_finder("ls", path, sizeof(path));
+		samples[r] = now_ns() - start;
+	}
+	record("path_finder", "ns", false, samples, rounds);
+	for (int r = 0; r < rounds; ++r)
+	{
+		double start = now_ns();
+		path_finder("seashell-no-such-command", path, sizeof(path));
+		samples[r] = now_ns() - start;
+	}
+	record("path_finder_miss", "ns", false, samples, rounds);
+	free(samples);
+}
+static void bench_spawn(int rounds)
+{
+	double *samples = malloc(sizeof(double) * rounds);
+	for (int r = 0; r < rounds; ++r)
+	{
+		double start = now_ns();
+		run_line("true");
+		samples[r] = (now_ns() - start) / 1e3;
+	}
+	record("spawn", "us", false, samples, rounds);
+	free(samples);
+}
+static void bench_pipeline(int mb, int rounds)
+{
+	char line[256];
+	double *samples = malloc(sizeof(double) * rounds);
+	snprintf(line, sizeof(line), "head -c %lld /dev/zero | cat | cat > /dev/null", (long long)mb << 20);
+	for (int r = 0; r < rounds; ++r)
+	{
+		double start = now_ns();
+		run_line(line);
+		samples[r] = mb / ((now_ns() - start) / 1e9);
+	}
+	record("pipeline", "MB/s", true, samples, rounds);
+	free(samples);
+}
+static void bench_highlight(int mb, int rounds)
+{
+	char path[PATH_MAX], line[PATH_MAX + 64];
+	double *samples = malloc(sizeof(double) * rounds);
+	snprintf(path, sizeof(path), "%s/highlight.txt", work_dir);
+	make_text_file(path, mb, 0);
+	snprintf(line, sizeof(line), "highlight needle r %s", path);
+	quiet(true);
+	for (int r = 0; r < rounds; ++r)
+	{
+		double start = now_ns();
+		run_line(line);
+		samples[r] = mb / ((now_ns() - start) / 1e9);
+	}
+	quiet(false);
+	record("highlight", "MB/s", true, samples, rounds);
+
+	// one pass for many words: a handful, then thousands that never match
+	char patterns[PATH_MAX];
+	snprintf(patterns, sizeof(patterns), "%s/patterns.txt", work_dir);
+	const int counts[] = {5, 5000};
+	const char *names[] = {"highlight_5", "highlight_5000"}; // record keeps the name
+	for (int c = 0; c < 2; ++c)
+	{
+		FILE *f = fopen(patterns, "w");
+		if (f == NULL)
+			break;
+		fprintf(f, "needle:r\nsignal:g\nkernel:b\npipe:r\nfork:g\n");
+		for (int i = 5; i < counts[c]; ++i)
+			fprintf(f, "term%d:b\n", i);
+		fclose(f);
+		snprintf(line, sizeof(line), "highlight -f %s %s", patterns, path);
+		quiet(true);
+		for (int r = 0; r < rounds; ++r)
+		{
+			double start = now_ns();
+			run_line(line);
+			samples[r] = mb / ((now_ns() - start) / 1e9);
+		}
+		quiet(false);
+		record(names[c], "MB/s", true, samples, rounds);
+	}
+	unlink(patterns);
+	unlink(path);
+	free(samples);
+}
+static void bench_kdiff(int mb, int rounds)
+{
+	char first[PATH_MAX], second[PATH_MAX], line[2 * PATH_MAX + 64];
+	double *samples = malloc(sizeof(double) * rounds);
+	snprintf(first, sizeof(first), "%s/kdiff1.txt", work_dir);
+	snprintf(second, sizeof(second), "%s/kdiff2.txt", work_dir);
+	make_text_file(first, mb, 0);
+	make_text_file(second, mb, 4);
+
+	const char *modes[] = {"-a", "-b"};
+	const char *names[] = {"kdiff_a", "kdiff_b"};
+	for (int m = 0; m < 2; ++m)
+	{
+		snprintf(line, sizeof(line), "kdiff %s %s %s", modes[m], first, second);
+		quiet(true);
+		for (int r = 0; r < rounds; ++r)
+		{
+			double start = now_ns();
+			run_line(line);
+			samples[r] = mb / ((now_ns() - start) / 1e9);
+		}
+		quiet(false);
+		record(names[m], "MB/s", true, samples, rounds);
+	}
+	unlink(first);
+	unlink(second);
+	free(samples);
+}
+/**
+ * Fill a shortdir store of its own with `count` names, all for the work
+ * directory, through the import of an old style list
+ */
+static bool shortdir_populate(int count)
+{
+	char path[PATH_MAX + 16];
+	snprintf(path, sizeof(path), "%s/shortdirs.txt", work_dir);
+	setenv("XDG_DATA_HOME", work_dir, 1);
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return false;
+	for (int i = 0; i < count; ++i)
+		fprintf(f, "dir%d -> %s\n", i, work_dir);
+	if (fclose(f) != 0)
+		return false;
+	snprintf(path, sizeof(path), "shortdir import %s/shortdirs.txt", work_dir);
+	quiet(true);
+	int code = run_line(path);
+	quiet(false);
+	return code == SUCCESS;
+}
+static void bench_shortdir(int rounds)
+{
+	char cwd[PATH_MAX], path[PATH_MAX + 32], line[64];
+	double *samples = malloc(sizeof(double) * rounds);
+	getcwd(cwd, sizeof(cwd));
+	if (shortdir_populate(SHORTDIR_ENTRIES))
+	{
+		unsigned state = 1;
+		quiet(true);
+		for (int r = 0; r < rounds; ++r)
+		{
+			state = state * 1103515245 + 12345;
+			snprintf(line, sizeof(line), "shortdir jump dir%u", (state >> 8) % SHORTDIR_ENTRIES);
+			double start = now_ns();
+			run_line(line);
+			samples[r] = (now_ns() - start) / 1e3;
+		}
+		quiet(false);
+		record("shortdir_jump", "us", false, samples, rounds);
+	}
+	else
+		fprintf(stderr, "shortdir: cannot fill the store\n");
+
+	// frecency ranking over as many visited directories
+	snprintf(path, sizeof(path), "%s/seashell/dirs", work_dir);
+	FILE *f = fopen(path, "w");
+	if (f)
+	{
+		time_t now = time(NULL);
+		for (int i = 0; i < SHORTDIR_ENTRIES; ++i)
+			fprintf(f, "/home/user/src/project%d/module%d/part%d|%d|%ld\n", i / 100, i % 100 / 10, i % 10,
+					1 + i % 7, (long)(now - i * 60));
+		fclose(f);
+		const char *queries[] = {"project%u", "module%u", "prj%ut", "part%u"};
+		unsigned state = 1;
+		quiet(true);
+		for (int r = 0; r < rounds; ++r)
+		{
+			char query[32];
+			state = state * 1103515245 + 12345;
+			snprintf(query, sizeof(query), queries[r % 4], (state >> 8) % 1000);
+			snprintf(line, sizeof(line), "shortdir top %s", query);
+			double start = now_ns();
+			run_line(line);
+			samples[r] = (now_ns() - start) / 1e3;
+		}
+		quiet(false);
+		record("shortdir_rank", "us", false, samples, rounds);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/seashell/dirs.log", work_dir);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/shortdirs.txt", work_dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/seashell/shortdirs", work_dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/seashell", work_dir);
+	rmdir(path);
+	shell_chdir(cwd);
+	free(samples);
+}
+static void write_results(const char *path, const char *tag)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return;
+	}
+	fprintf(f, "{\n  \"tag\": \"");
+	for (const char *c = tag; *c; ++c) // the tag is free text, quote it as a JSON string
+		if (*c == '"' || *c == '\\')
+			fprintf(f, "\\%c", *c);
+		else if ((unsigned char)*c < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else
+			fputc(*c, f);
+	fprintf(f, "\",\n  \"results\": [\n");
+	for (int i = 0; i < result_count; ++i)
+	{
+		struct bench_result *r = &results[i];
+		fprintf(f,
+				"    {\"name\": \"%s\", \"unit\": \"%s\", \"better\": \"%s\", \"samples\": %d, "
+				"\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f, "
+				"\"mean\": %.3f}%s\n",
+				r->name, r->unit, r->higher_is_better ? "higher" : "lower", r->samples, r->min,
+				r->p50, r->p90, r->p99, r->max, r->mean, i + 1 < result_count ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	fclose(f);
+}
+static bool selected(const char *name, char **names, int count)
+{
+	if (count == 0)
+		return true;
+	for (int i = 0; i < count; ++i)
+		if (strcmp(names[i], name) == 0)
+			return true;
+	return false;
+}
+int main(int argc, char *argv[])
+{
+	const char *output = "bench-results.json", *tag = "", *corpus = "bench/commands.txt";
+	int rounds = 2000, large_rounds = 3, highlight_mb = 1024, kdiff_mb = 256, pipeline_mb = 256;
+	int opt;
+	while ((opt = getopt(argc, argv, "o:t:c:n:r:s:k:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'o':
+			output = optarg;
+			break;
+		case 't':
+			tag = optarg;
+			break;
+		case 'c':
+			corpus = optarg;
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		case 'r':
+			large_rounds = atoi(optarg);
+			break;
+		case 's':
+			highlight_mb = atoi(optarg);
+			break;
+		case 'k':
+			kdiff_mb = atoi(optarg);
+			break;
+		case 'p':
+			pipeline_mb = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o file] [-t tag] [-c corpus] [-n rounds] [-r rounds] "
+							"[-s MB] [-k MB] [-p MB] [benchmark ...]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+	if (rounds < 1 || large_rounds < 1 || highlight_mb < 1 || kdiff_mb < 1 || pipeline_mb < 1)
+	{
+		fprintf(stderr, "%s: counts and sizes must be positive\n", argv[0]);
+		return 2;
+	}
+	char **names = argv + optind;
+	int name_count = argc - optind;
+
+	const char *tmp = getenv("TMPDIR");
+	snprintf(work_dir, sizeof(work_dir), "%s/seashell-bench.XXXXXX", tmp ? tmp : "/tmp");
+	if (mkdtemp(work_dir) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", work_dir, strerror(errno));
+		return 1;
+	}
+	// with its cache kdiff would answer later rounds without reading the files,
+	// and leave entries in the user's data directory
+	setenv("SEASHELL_KDIFF_CACHE", "0", 1);
+	jobs_init();
+
+	if (selected("parse", names, name_count))
+		bench_parse(corpus, rounds);
+	if (selected("path_finder", names, name_count))
+		bench_path_finder(rounds);
+	if (selected("spawn", names, name_count))
+		bench_spawn(rounds);
+	if (selected("pipeline", names, name_count))
+		bench_pipeline(pipeline_mb, large_rounds);
+	if (selected("highlight", names, name_count))
+		bench_highlight(highlight_mb, large_rounds);
+	if (selected("kdiff", names, name_count))
+		bench_kdiff(kdiff_mb, large_rounds);
+	if (selected("shortdir", names, name_count))
+		bench_shortdir(rounds);
+
+	rmdir(work_dir);
+	write_results(output, tag);
+	return 0;
+}
@@ -0,0 +1,76 @@
+// Authors: Tunaberk Almaci, Aybars Inci
+//
+// parse_command throughput over a corpus of real command lines, one line per
+// corpus entry, resetting the line arena after each line like main() does.
+//
+//   cc -O2 -o parse_bench bench/parse_bench.c
+//   ./parse_bench [rounds] [corpus]     (defaults: 20000, bench/commands.txt)
+
+#define SEASHELL_NO_MAIN
+#include "../seashell.c"
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+	const char *corpus_path = argc > 2 ? argv[2] : "bench/commands.txt";
+	FILE *corpus = fopen(corpus_path, "r");
+	if (corpus == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", corpus_path, strerror(errno));
+		return 1;
+	}
+
+	char **lines = NULL;
+	int line_count = 0;
+	size_t bytes = 0;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+	while ((n = getline(&line, &cap, corpus)) > 0)
+	{
+		if (line[n - 1] == '\n')
+			line[--n] = 0;
+		lines = realloc(lines, sizeof(char *) * (line_count + 1));
+		lines[line_count++] = strdup(line);
+		bytes += n;
+	}
+	fclose(corpus);
+	free(line);
+
+	// parse_command prints syntax errors; keep them out of the numbers
+	freopen("/dev/null", "w", stdout);
+	double *samples = malloc(sizeof(double) * rounds);
+	for (int r = 0; r < rounds; ++r)
+	{
+		double start = now_ns();
+		for (int i = 0; i < line_count; ++i)
+		{
+			struct command_t *command = arena_alloc(&line_arena, sizeof(struct command_t));
+			memset(command, 0, sizeof(struct command_t));
+			parse_command(lines[i], command);
+			arena_reset(&line_arena);
+		}
+		samples[r] = (now_ns() - start) / line_count;
+	}
+	qsort(samples, rounds, sizeof(double), compare_double);
+
+	double total = 0;
+	for (int r = 0; r < rounds; ++r)
+		total += samples[r] * line_count;
+	fprintf(stderr, "%d lines x %d rounds: %.0f lines/s, %.1f MB/s\n", line_count, rounds,
+			(double)line_count * rounds / (total / 1e9), (double)bytes * rounds / (total / 1e3));
+	fprintf(stderr, "ns/line  p50=%.1f  p90=%.1f  p99=%.1f\n", samples[rounds / 2],
+			samples[rounds * 9 / 10], samples[rounds * 99 / 100]);
+	return 0;
+}
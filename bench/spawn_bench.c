@@ -0,0 +1,85 @@
+// Authors: Tunaberk Almaci, Aybars Inci
+//
+// Compares command startup latency of the old fork()+execv path with the
+// posix_spawn based launch_process() while the shell's resident set grows.
+//
+//   cc -O2 -o spawn_bench bench/spawn_bench.c && ./spawn_bench [iterations]
+
+#define SEASHELL_NO_MAIN
+#include "../seashell.c"
+
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+static void report(const char *method, size_t rss_mb, double *samples, int n)
+{
+	qsort(samples, n, sizeof(double), compare_double);
+	printf("%-12s rss=%5zuMB  p50=%8.1fus  p90=%8.1fus  p99=%8.1fus\n", method, rss_mb,
+		   samples[n / 2], samples[n * 9 / 10], samples[n * 99 / 100]);
+}
+static void run_fork(const char *path, char **argv, double *samples, int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		double start = now_us();
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			execv(path, argv);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+		samples[i] = now_us() - start;
+	}
+}
+static void run_spawn(const char *path, char **argv, double *samples, int n)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		double start = now_us();
+		struct launch_t launch = {path, argv, {-1, -1, -1}, NULL, 0, 0, false};
+		pid_t pid = launch_process(&launch);
+		waitpid(pid, NULL, 0);
+		samples[i] = now_us() - start;
+	}
+}
+int main(int argc, char *argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 200;
+	size_t rss_steps[] = {0, 256, 1024};
+	char path[PATH_MAX];
+	char *child_argv[] = {"true", NULL};
+	double *samples = malloc(sizeof(double) * iterations);
+	char *ballast = NULL;
+	size_t ballast_mb = 0;
+
+	if (path_finder("true", path, sizeof(path)) == -1)
+	{
+		fprintf(stderr, "true: command not found\n");
+		return 1;
+	}
+
+	for (size_t s = 0; s < sizeof(rss_steps) / sizeof(rss_steps[0]); ++s)
+	{
+		// grow and touch the heap so fork has real page tables to copy
+		ballast = realloc(ballast, rss_steps[s] << 20 | 1);
+		memset(ballast + (ballast_mb << 20), 1, (rss_steps[s] - ballast_mb) << 20);
+		ballast_mb = rss_steps[s];
+
+		run_fork(path, child_argv, samples, iterations);
+		report("fork+execv", ballast_mb, samples, iterations);
+		run_spawn(path, child_argv, samples, iterations);
+		report("posix_spawn", ballast_mb, samples, iterations);
+	}
+	free(ballast);
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,82 @@
+// Authors: Tunaberk Almaci, Aybars Inci
+//
+// Checks that compacting the directory log keeps every visit exactly once:
+// the log is emptied when it is folded into the snapshot, and the ranks read
+// back afterwards are the visits that were logged. The snapshot is 0600 like
+// the other files in the data directory.
+//
+//   make test
+
+#define SEASHELL_NO_MAIN
+#include "../seashell.c"
+
+#define TEST_DIRS 50
+#define TEST_VISITS 400 // per directory, enough for several compactions
+
+static char work_dir[PATH_MAX];
+
+static void wait_compaction()
+{
+	while (atomic_load(&frecency_compacting))
+		usleep(1000);
+}
+static off_t log_size()
+{
+	struct stat st;
+	return stat(frecency_files.log, &st) == 0 ? st.st_size : -1;
+}
+int main()
+{
+	const char *tmp = getenv("TMPDIR");
+	snprintf(work_dir, sizeof(work_dir), "%s/seashell-test.XXXXXX", tmp ? tmp : "/tmp");
+	if (mkdtemp(work_dir) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", work_dir, strerror(errno));
+		return 1;
+	}
+	setenv("XDG_DATA_HOME", work_dir, 1);
+
+	char path[PATH_MAX + 32];
+	for (int v = 0; v < TEST_VISITS; ++v)
+		for (int d = 0; d < TEST_DIRS; ++d)
+		{
+			snprintf(path, sizeof(path), "%s/dir%d", work_dir, d);
+			frecency_log(path, false);
+			wait_compaction(); // the next visit would have to wait for its lock anyway
+		}
+
+	int failed = 0;
+	atomic_store(&frecency_compacting, true);
+	frecency_compact(NULL);
+	if (log_size() != 0)
+	{
+		fprintf(stderr, "log not emptied by compaction: %lld bytes\n", (long long)log_size());
+		failed++;
+	}
+	frecency_sync();
+	for (int d = 0; d < TEST_DIRS; ++d)
+	{
+		snprintf(path, sizeof(path), "%s/dir%d", work_dir, d);
+		uint32_t index = frecency_dir(&frecency, path, strlen(path), false);
+		float rank = index == UINT32_MAX ? 0 : frecency.visits[index].rank;
+		if (rank != TEST_VISITS)
+		{
+			fprintf(stderr, "%s: rank %.0f, expected %d\n", path, rank, TEST_VISITS);
+			failed++;
+		}
+	}
+
+	struct stat st;
+	if (stat(frecency_files.snapshot, &st) == 0 && (st.st_mode & 0777) != 0600)
+	{
+		fprintf(stderr, "snapshot mode %o, expected 600\n", st.st_mode & 0777);
+		failed++;
+	}
+	unlink(frecency_files.snapshot);
+	unlink(frecency_files.log);
+	snprintf(path, sizeof(path), "%s/seashell", work_dir);
+	rmdir(path);
+	rmdir(work_dir);
+	printf("frecency_test: %s\n", failed ? "FAILED" : "ok");
+	return failed != 0;
+}